@@ -25,6 +25,7 @@
 #include "llvm/ExecutionEngine/SectionMemoryManager.h"
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/LLVMContext.h"
+#include <atomic>
 #include <memory>
 
 namespace llvm
@@ -32,11 +33,55 @@ namespace llvm
   namespace orc
   {
 
+    // SectionMemoryManager that keeps a running total of the bytes it hands
+    // out. one is created per object file and destroyed when it is removed.
+    class CountingMemoryManager : public SectionMemoryManager
+    {
+      std::atomic<size_t> &Live;
+      std::atomic<size_t> &Peak;
+      size_t Allocated = 0;
+
+      void record(uintptr_t Size)
+      {
+        Allocated += Size;
+        size_t Now = Live += Size;
+        size_t Old = Peak.load();
+        while (Now > Old && !Peak.compare_exchange_weak(Old, Now))
+          ; // another thread raised it, Old now holds its value
+      }
+
+    public:
+      CountingMemoryManager(std::atomic<size_t> &Live, std::atomic<size_t> &Peak)
+          : Live(Live), Peak(Peak) {}
+      ~CountingMemoryManager() override { Live -= Allocated; }
+
+      uint8_t *allocateCodeSection(uintptr_t Size, unsigned Alignment,
+                                   unsigned SectionID,
+                                   StringRef SectionName) override
+      {
+        record(Size);
+        return SectionMemoryManager::allocateCodeSection(Size, Alignment, SectionID,
+                                                         SectionName);
+      }
+
+      uint8_t *allocateDataSection(uintptr_t Size, unsigned Alignment,
+                                   unsigned SectionID, StringRef SectionName,
+                                   bool IsReadOnly) override
+      {
+        record(Size);
+        return SectionMemoryManager::allocateDataSection(Size, Alignment, SectionID,
+                                                         SectionName, IsReadOnly);
+      }
+    };
+
     class KaleidoscopeJIT
     {
     private:
       std::unique_ptr<ExecutionSession> ES;
 
+      std::atomic<size_t> LiveCodeBytes{0}; // code and data sections held by the jit
+      std::atomic<size_t> PeakCodeBytes{0};
+
       DataLayout DL;
       MangleAndInterner Mangle;
 
@@ -50,8 +95,8 @@ namespace llvm
                       JITTargetMachineBuilder JTMB, DataLayout DL)
           : ES(std::move(ES)), DL(std::move(DL)), Mangle(*this->ES, this->DL),
             ObjectLayer(*this->ES,
-                        []()
-                        { return std::make_unique<SectionMemoryManager>(); }),
+                        [this]()
+                        { return std::make_unique<CountingMemoryManager>(LiveCodeBytes, PeakCodeBytes); }),
             CompileLayer(*this->ES, ObjectLayer,
                          std::make_unique<ConcurrentIRCompiler>(std::move(JTMB))),
             MainJD(this->ES->createBareJITDylib("<main>"))
@@ -95,6 +140,38 @@ namespace llvm
 
       JITDylib &getMainJITDylib() { return MainJD; }
 
+      size_t getLiveCodeBytes() const { return LiveCodeBytes; }
+      size_t getPeakCodeBytes() const { return PeakCodeBytes; }
+
+      // session errors (e.g. unresolved symbols while materializing) go to
+      // errs() unless the client routes them elsewhere
+      void setErrorReporter(ExecutionSession::ErrorReporter Reporter)
+      {
+        ES->setErrorReporter(std::move(Reporter));
+      }
+
+      // define host addresses for a batch of symbols with one absoluteSymbols
+      // unit, instead of a generator lookup per symbol on first reference
+      Error defineAbsoluteSymbols(
+          ArrayRef<std::pair<std::string, JITTargetAddress>> Symbols)
+      {
+        SymbolMap Map;
+        for (auto &S : Symbols)
+          Map[Mangle(S.first)] = JITEvaluatedSymbol(
+              S.second, JITSymbolFlags::Exported | JITSymbolFlags::Callable);
+        return MainJD.define(absoluteSymbols(std::move(Map)));
+      }
+
+      // take back symbols bound by defineAbsoluteSymbols, e.g. when a jitted
+      // definition takes over the name of an extern
+      Error removeSymbols(ArrayRef<std::string> Names)
+      {
+        SymbolNameSet Set;
+        for (auto &Name : Names)
+          Set.insert(Mangle(Name));
+        return MainJD.remove(Set);
+      }
+
       Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr)
       {
         if (!RT)
@@ -1,4 +1,4 @@
-// #include "../include/KaleidoscopeJIT.h"
+#include "KaleidoscopeJIT.h"
 #include "llvm/ADT/APFloat.h"
 #include "llvm/ADT/STLExtras.h"
 #include "llvm/IR/BasicBlock.h"
@@ -6,12 +6,20 @@
 #include "llvm/IR/DerivedTypes.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Intrinsics.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/MDBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Type.h"
 #include "llvm/IR/Verifier.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ThreadPool.h"
 #include "llvm/Target/TargetMachine.h"
 #include "llvm/Transforms/InstCombine/InstCombine.h"
 #include "llvm/Transforms/Scalar.h"
@@ -21,15 +29,28 @@
 #include <memory>
 #include <vector>
 #include <map>
+#include <mutex>
+#include <set>
 
 // ADDED
 #include <algorithm>
 #include <cctype>
+#include <chrono>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <deque>
+
+#include <sys/resource.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 // ADDED
 
 using namespace llvm;
+using namespace llvm::orc;
 using std::cout;
 using std::endl;
 using std::make_unique;
@@ -57,24 +78,50 @@ enum Token
     tok_number = -5,
 };
 
+// position in the source, line 0 when there is none (binary AST, files, ...)
+struct SourceLocation
+{
+    int Line;
+    int Col;
+};
+
 // global variables
-static string identifierStr; // identifier string saved here
-static double numVal;        // number saved here
+static string identifierStr;             // identifier string saved here
+static double numVal;                    // number saved here
+static FILE *InputFile;                  // source being lexed, stdin unless a file is given
+static int lastChar = ' ';               // last character read, reset when switching input
+static SourceLocation CurLoc;            // where the current token starts
+static SourceLocation LexLoc = {1, 0};   // where lastChar was read
+static const SourceLocation NoLocation = {0, 0};
+
+// read the next character, keeping track of lines and columns
+static int advance()
+{
+    int c = getc(InputFile);
+    if (c == '\n')
+    {
+        LexLoc.Line++;
+        LexLoc.Col = 0;
+    }
+    else if (c != '\r') // CRLF is one line break, the \n counts it
+        LexLoc.Col++;
+    return c;
+}
 
 // get tokens, remove white space
 static int getTok()
 {
-    static int lastChar = ' '; // empty string
-
     // remove whitespace
     while (isspace(lastChar))
-        lastChar = getchar();
+        lastChar = advance();
+
+    CurLoc = LexLoc; // the token starts at lastChar
 
     // recognize identfiers and keywords - gets identifiers
     if (isalpha(lastChar))
     { // [a-zA-Z][a-zA-Z0-9] - specifies valid identifiers
         identifierStr = lastChar;
-        while (isalnum((lastChar = getchar()))) // while next letter is alphanumeric
+        while (isalnum((lastChar = advance()))) // while next letter is alphanumeric
             identifierStr += lastChar;
         if (identifierStr == "def")
             return tok_def; // def keyword, return the corresponding token
@@ -90,7 +137,7 @@ static int getTok()
         do
         {
             numStr += lastChar;   // append to numStr
-            lastChar = getchar(); // get next character
+            lastChar = advance(); // get next character
         } while (isdigit(lastChar) || lastChar == '.');
         numVal = strtod(numStr.c_str(), nullptr); // do while numbers/dots are available
         return tok_number;                        // return number token
@@ -100,7 +147,7 @@ static int getTok()
     if (lastChar == '#')
     { // '#' sign starts comments
         do
-            lastChar = getchar();
+            lastChar = advance();
         while (lastChar != EOF && lastChar != '\n' && lastChar != '\r'); // not end of file, new line or carriage return, read
 
         if (lastChar != EOF)
@@ -113,7 +160,7 @@ static int getTok()
 
     // return character in ASCII code
     int currChar = lastChar;
-    lastChar = getchar(); // reset lastChar
+    lastChar = advance(); // reset lastChar
     return currChar;
 }
 
@@ -121,13 +168,23 @@ static int getTok()
 
 namespace // anonymous namespace
 {
+    class ASTWriter; // binary AST serializer, see AST SERIALIZATION
+
     // the base class for all nodes of the AST
     class ExprAST
     {
+        SourceLocation Loc; // for diagnostics
+
     public:
+        ExprAST(SourceLocation Loc = CurLoc) : Loc(Loc) {}
         virtual ~ExprAST() {}
+        const SourceLocation &getLoc() const { return Loc; }
         // virtual implementation not implemented = 0
         virtual Value *codegen() = 0;
+        virtual void serialize(ASTWriter &W) const = 0;
+        // interpreter tier, see INTERPRETER
+        virtual bool interpretable(unsigned &Cost) = 0;
+        virtual double interpret() const = 0;
     };
 
     // class for numeric literals
@@ -138,6 +195,9 @@ namespace // anonymous namespace
     public:
         NumberExprAST(double d) : Val(d) {}
         virtual Value *codegen();
+        virtual void serialize(ASTWriter &W) const;
+        virtual bool interpretable(unsigned &Cost);
+        virtual double interpret() const;
     };
 
     // expressions
@@ -146,8 +206,11 @@ namespace // anonymous namespace
         string Name;
 
     public:
-        VariableExprAST(const string &Name) : Name(Name) {}
+        VariableExprAST(const string &Name, SourceLocation Loc = CurLoc) : ExprAST(Loc), Name(Name) {}
         virtual Value *codegen();
+        virtual void serialize(ASTWriter &W) const;
+        virtual bool interpretable(unsigned &Cost);
+        virtual double interpret() const;
     };
 
     // binary expressions
@@ -158,9 +221,12 @@ namespace // anonymous namespace
 
     public:
         BinaryExprAST(char Op, unique_ptr<ExprAST> LHS,
-                      unique_ptr<ExprAST> RHS)
-            : Op(Op), LHS(move(LHS)), RHS(move(RHS)) {}
+                      unique_ptr<ExprAST> RHS, SourceLocation Loc = CurLoc)
+            : ExprAST(Loc), Op(Op), LHS(move(LHS)), RHS(move(RHS)) {}
         virtual Value *codegen();
+        virtual void serialize(ASTWriter &W) const;
+        virtual bool interpretable(unsigned &Cost);
+        virtual double interpret() const;
     };
 
     // function calls
@@ -168,12 +234,16 @@ namespace // anonymous namespace
     {
         string Callee;
         vector<unique_ptr<ExprAST>> Args;
+        JITTargetAddress CalleeAddr = 0; // compiled callee, resolved by interpretable()
 
     public:
         CallExprAST(const string &Callee,
-                    vector<unique_ptr<ExprAST>> Args)
-            : Callee(Callee), Args(move(Args)) {}
+                    vector<unique_ptr<ExprAST>> Args, SourceLocation Loc = CurLoc)
+            : ExprAST(Loc), Callee(Callee), Args(move(Args)) {}
         virtual Value *codegen();
+        virtual void serialize(ASTWriter &W) const;
+        virtual bool interpretable(unsigned &Cost);
+        virtual double interpret() const;
     };
 
     // function prototypes
@@ -186,7 +256,9 @@ namespace // anonymous namespace
         PrototypeAST(const string &name, vector<string> Args)
             : Name(name), Args(move(Args)) {}
         Function *codegen();
+        void serialize(ASTWriter &W) const;
         const string &getName() const { return Name; }
+        const vector<string> &getArgs() const { return Args; }
     };
 
     // function definition
@@ -200,7 +272,30 @@ namespace // anonymous namespace
                     unique_ptr<ExprAST> Body)
             : Proto(move(Proto)), Body(move(Body)) {}
         Function *codegen();
+        Function *codegenBody(PrototypeAST &P);
+        void serialize(ASTWriter &W) const;
+        unique_ptr<PrototypeAST> takeProto() { return move(Proto); }
+        const string &getName() const { return Proto->getName(); }
+        ExprAST &getBody() { return *Body; }
+        unique_ptr<ExprAST> takeBody() { return move(Body); }
+    };
+
+    // a parsed top-level item, kept when the whole program is needed at once
+    struct TopLevelAST
+    {
+        enum ItemKind
+        {
+            Extern = 0,
+            Definition = 1,
+            Expression = 2,
+        };
+
+        ItemKind Kind;
+        unique_ptr<PrototypeAST> Proto; // externs
+        unique_ptr<FunctionAST> Fn;     // definitions and top-level expressions
     };
+
+    typedef vector<TopLevelAST> ProgramAST;
 } // end anonymous namespace
 
 // THE PARSER
@@ -232,10 +327,63 @@ static int getTokPrecedence()
     }
 }
 
-// error reporting for expressions
+// DIAGNOSTICS
+// errors are collected and written out together by flushDiagnostics(), after
+// MaxErrors the rest are only counted and the drivers stop reading input
+struct Diagnostic
+{
+    SourceLocation Loc;
+    string Message;
+};
+
+static const size_t MaxErrors = 20;
+static vector<Diagnostic> Diagnostics;
+static size_t ErrorCount = 0;
+static std::mutex DiagnosticsMutex; // batch partitions report from worker threads
+
+void LogError(SourceLocation Loc, const string &Str)
+{
+    std::lock_guard<std::mutex> Lock(DiagnosticsMutex);
+    if (++ErrorCount < MaxErrors)
+        Diagnostics.push_back({Loc, Str});
+    else if (ErrorCount == MaxErrors)
+        Diagnostics.push_back({Loc, Str + " (too many errors, stopping)"});
+}
+
+// error at the current token
 void LogError(const char *Str)
 {
-    fprintf(stderr, "LogError: %s\n", Str); // print error
+    LogError(CurLoc, Str);
+}
+
+static bool tooManyErrors()
+{
+    return ErrorCount >= MaxErrors;
+}
+
+// write out pending diagnostics in source order, in one go
+static void flushDiagnostics()
+{
+    std::lock_guard<std::mutex> Lock(DiagnosticsMutex);
+    std::stable_sort(Diagnostics.begin(), Diagnostics.end(), [](const Diagnostic &A, const Diagnostic &B)
+                     { return A.Loc.Line != B.Loc.Line ? A.Loc.Line < B.Loc.Line : A.Loc.Col < B.Loc.Col; });
+    string Out;
+    for (auto &D : Diagnostics)
+    {
+        if (D.Loc.Line)
+            Out += std::to_string(D.Loc.Line) + ":" + std::to_string(D.Loc.Col) + ": ";
+        Out += "error: " + D.Message + "\n";
+    }
+    fputs(Out.c_str(), stderr);
+    Diagnostics.clear();
+}
+
+// error recovery: skip to the start of the next top-level item instead of
+// parsing the rest of a broken one as new items, one token at a time
+static void synchronize()
+{
+    while (currTok != tok_eof && currTok != tok_def && currTok != tok_extern && currTok != ';')
+        getNextToken();
 }
 
 static unique_ptr<ExprAST> ParseExpression();
@@ -269,11 +417,12 @@ static unique_ptr<ExprAST> ParseParenExpr()
 static unique_ptr<ExprAST> ParseIdentifierOrCallExpr()
 {
     string idName = identifierStr;
+    SourceLocation idLoc = CurLoc;
 
     getNextToken(); // eat identifier.
 
     if (currTok != '(') // Simple variable ref.
-        return make_unique<VariableExprAST>(idName);
+        return make_unique<VariableExprAST>(idName, idLoc);
 
     // Call.
     getNextToken(); // eat (
@@ -302,7 +451,7 @@ static unique_ptr<ExprAST> ParseIdentifierOrCallExpr()
     // Eat the ')'.
     getNextToken();
 
-    return make_unique<CallExprAST>(idName, move(Args));
+    return make_unique<CallExprAST>(idName, move(Args), idLoc);
 }
 
 // PARSING PRIMARIES
@@ -317,7 +466,7 @@ static unique_ptr<ExprAST> ParsePrimary()
     case '(':                               // parenthesis
         return ParseParenExpr();            // parse parenthesis
     default:                                // report error
-        LogError("Unknown token. expected an expression \n");
+        LogError("Unknown token. expected an expression");
         return nullptr;
     }
 }
@@ -337,6 +486,7 @@ static unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec, unique_ptr<ExprAST> LHS)
         else
         {
             int BinOp = currTok;
+            SourceLocation BinLoc = CurLoc;
             getNextToken(); // eat binop
 
             // Parse the primary expression after the binary operator.
@@ -351,7 +501,7 @@ static unique_ptr<ExprAST> ParseBinOpRHS(int ExprPrec, unique_ptr<ExprAST> LHS)
                         return nullptr;
                 }
                 // merge curr LHS, curr RHS to make a new binary expression AST as new LHS
-                LHS = make_unique<BinaryExprAST>(BinOp, move(LHS), move(RHS));
+                LHS = make_unique<BinaryExprAST>(BinOp, move(LHS), move(RHS), BinLoc);
             }
             else
                 return nullptr;
@@ -377,7 +527,7 @@ static unique_ptr<PrototypeAST> ParsePrototype()
 {
     if (currTok != tok_identifier)
     {                                                       // current token, not token identfier
-        LogError("Expected function name in prototype \n"); // report error
+        LogError("Expected function name in prototype"); // report error
         return nullptr;
     }
 
@@ -386,7 +536,7 @@ static unique_ptr<PrototypeAST> ParsePrototype()
 
     if (currTok != '(')
     { // report error
-        LogError("Expected '(' in prototype \n");
+        LogError("Expected '(' in prototype");
         return nullptr;
     }
 
@@ -396,7 +546,7 @@ static unique_ptr<PrototypeAST> ParsePrototype()
         argNames.push_back(identifierStr); // add to vector
     if (currTok != ')')
     { // report error
-        LogError("Expected ')' in prototype \n");
+        LogError("Expected ')' in prototype");
         return nullptr;
     }
 
@@ -435,23 +585,642 @@ static unique_ptr<FunctionAST> ParseTopLevelExpr()
     if (E)
     {
         // Make an anonymous proto.
-        auto proto = make_unique<PrototypeAST>("", vector<string>());
+        auto proto = make_unique<PrototypeAST>("__anon_expr", vector<string>());
         return make_unique<FunctionAST>(move(proto), move(E));
     }
     return nullptr;
 }
 
+// PARSE-ONLY DRIVER - collect the whole program, no code generation
+static void ParseProgram(ProgramAST &Program)
+{
+    getNextToken(); // prime the first token
+    while (currTok != tok_eof && !tooManyErrors())
+    {
+        TopLevelAST Item;
+        switch (currTok)
+        {
+        case ';': // ignore top-level semicolons.
+            getNextToken();
+            continue;
+        case tok_def:
+            Item.Kind = TopLevelAST::Definition;
+            Item.Fn = ParseDefinition();
+            break;
+        case tok_extern:
+            Item.Kind = TopLevelAST::Extern;
+            Item.Proto = ParseExtern();
+            break;
+        default:
+            Item.Kind = TopLevelAST::Expression;
+            Item.Fn = ParseTopLevelExpr();
+            break;
+        }
+
+        if (Item.Fn || Item.Proto)
+            Program.push_back(move(Item));
+        else
+            synchronize(); // error recovery, on to the next item
+    }
+}
+
+// AST SERIALIZATION
+// compact binary form of a parsed program, loaded without lexing or parsing.
+// u32/f64 are in host byte order, vN is an unsigned LEB128 varint:
+//   header  : "KAST" | u32 version | u32 #names | u32 #items | u32 name bytes | u32 code bytes
+//   names   : #names x (vN length, bytes), a name is referred to by its index
+//   code    : #items records of u8 kind | prototype | body (definitions and top-level expressions)
+//   proto   : vN name | vN #args | #args x vN name
+//   expr    : u8 tag, then f64 value | vN name | u8 op, lhs, rhs | vN callee, vN #args, args
+//             | vN digits, u8 scale (a literal equal to digits / 10^scale, most of them)
+static const char ASTMagic[4] = {'K', 'A', 'S', 'T'};
+static const uint32_t ASTVersion = 2;
+static const unsigned MaxDecimalScale = 15;
+static const double Pow10[MaxDecimalScale + 1] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+                                                  1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15};
+
+enum ASTTag
+{
+    tag_number = 0,
+    tag_variable = 1,
+    tag_binary = 2,
+    tag_call = 3,
+    tag_decimal = 4,
+};
+
+namespace
+{
+    // writes AST nodes into a code buffer, every name is interned once
+    class ASTWriter
+    {
+        map<string, uint32_t> NameIds;
+        vector<string> Names;
+        string Code;
+
+    public:
+        void writeU8(uint8_t V) { Code.push_back(static_cast<char>(V)); }
+        void writeF64(double V) { Code.append(reinterpret_cast<const char *>(&V), sizeof(V)); }
+
+        static void writeVarint(string &Out, uint32_t V)
+        {
+            for (; V >= 0x80; V >>= 7)
+                Out.push_back(static_cast<char>(V | 0x80)); // low 7 bits, more to come
+            Out.push_back(static_cast<char>(V));
+        }
+        void writeVarint(uint32_t V) { writeVarint(Code, V); }
+
+        void writeName(const string &Name)
+        {
+            auto It = NameIds.find(Name);
+            if (It == NameIds.end())
+            {
+                It = NameIds.insert({Name, Names.size()}).first; // first use, intern it
+                Names.push_back(Name);
+            }
+            writeVarint(It->second);
+        }
+
+        bool writeFile(const string &Path, uint32_t NumItems);
+    };
+
+    // reads nodes straight out of a (memory-mapped) buffer, every read is bounds checked
+    class ASTReader
+    {
+        const char *Cur;
+        const char *End;
+        vector<string> Names; // interned names, nodes take their own copy
+        bool Failed = false;
+
+    public:
+        ASTReader(const char *Begin, const char *End) : Cur(Begin), End(End) {}
+
+        bool failed() const { return Failed; }
+        bool atEnd() const { return Cur == End; }
+
+        bool readBytes(void *Out, size_t Size)
+        {
+            if (Failed || static_cast<size_t>(End - Cur) < Size)
+                return !(Failed = true);
+            memcpy(Out, Cur, Size); // unaligned-safe
+            Cur += Size;
+            return true;
+        }
+
+        uint8_t readU8()
+        {
+            uint8_t V = 0;
+            readBytes(&V, sizeof(V));
+            return V;
+        }
+
+        uint32_t readU32()
+        {
+            uint32_t V = 0;
+            readBytes(&V, sizeof(V));
+            return V;
+        }
+
+        uint32_t readVarint()
+        {
+            uint32_t V = 0;
+            for (unsigned Shift = 0; Shift < 35 && Cur != End; Shift += 7)
+            {
+                uint8_t Byte = *Cur++;
+                V |= static_cast<uint32_t>(Byte & 0x7f) << Shift;
+                if (!(Byte & 0x80))
+                    return V;
+            }
+            Failed = true; // overlong or truncated
+            return 0;
+        }
+
+        double readF64()
+        {
+            double V = 0;
+            readBytes(&V, sizeof(V));
+            return V;
+        }
+
+        const string &readName()
+        {
+            static const string Empty;
+            uint32_t Id = readVarint();
+            if (Id >= Names.size())
+            {
+                Failed = true;
+                return Empty;
+            }
+            return Names[Id];
+        }
+
+        bool readHeader(uint32_t &NumItems);
+    };
+} // end anonymous namespace
+
+void NumberExprAST::serialize(ASTWriter &W) const
+{
+    // the shortest decimal form that divides back to exactly the same double
+    for (unsigned Scale = 0; Scale <= MaxDecimalScale && !std::signbit(Val); ++Scale)
+    {
+        double Digits = std::round(Val * Pow10[Scale]);
+        if (!(Digits <= UINT32_MAX))
+            break; // too many digits, infinity or nan
+        if (Digits / Pow10[Scale] == Val)
+        {
+            W.writeU8(tag_decimal);
+            W.writeVarint(static_cast<uint32_t>(Digits));
+            W.writeU8(Scale);
+            return;
+        }
+    }
+    W.writeU8(tag_number);
+    W.writeF64(Val);
+}
+
+void VariableExprAST::serialize(ASTWriter &W) const
+{
+    W.writeU8(tag_variable);
+    W.writeName(Name);
+}
+
+void BinaryExprAST::serialize(ASTWriter &W) const
+{
+    W.writeU8(tag_binary);
+    W.writeU8(Op);
+    LHS->serialize(W);
+    RHS->serialize(W);
+}
+
+void CallExprAST::serialize(ASTWriter &W) const
+{
+    W.writeU8(tag_call);
+    W.writeName(Callee);
+    W.writeVarint(Args.size());
+    for (auto &Arg : Args)
+        Arg->serialize(W);
+}
+
+void PrototypeAST::serialize(ASTWriter &W) const
+{
+    W.writeName(Name);
+    W.writeVarint(Args.size());
+    for (auto &Arg : Args)
+        W.writeName(Arg);
+}
+
+void FunctionAST::serialize(ASTWriter &W) const
+{
+    Proto->serialize(W);
+    Body->serialize(W);
+}
+
+bool ASTWriter::writeFile(const string &Path, uint32_t NumItems)
+{
+    std::error_code EC;
+    raw_fd_ostream OS(Path, EC, sys::fs::OF_None);
+    if (EC)
+    {
+        LogError(NoLocation, "could not open '" + Path + "': " + EC.message());
+        return false;
+    }
+
+    string NameBytes;
+    for (auto &Name : Names)
+    {
+        writeVarint(NameBytes, Name.size());
+        NameBytes += Name;
+    }
+
+    uint32_t Header[] = {ASTVersion, static_cast<uint32_t>(Names.size()), NumItems,
+                         static_cast<uint32_t>(NameBytes.size()), static_cast<uint32_t>(Code.size())};
+    OS.write(ASTMagic, sizeof(ASTMagic));
+    OS.write(reinterpret_cast<const char *>(Header), sizeof(Header));
+    OS << NameBytes << Code;
+    return !OS.has_error();
+}
+
+bool ASTReader::readHeader(uint32_t &NumItems)
+{
+    char Magic[sizeof(ASTMagic)];
+    if (!readBytes(Magic, sizeof(Magic)) || memcmp(Magic, ASTMagic, sizeof(Magic)) != 0)
+    {
+        LogError(NoLocation, "not a binary AST file");
+        return false;
+    }
+    if (readU32() != ASTVersion)
+    {
+        LogError(NoLocation, "unsupported binary AST version");
+        return false;
+    }
+
+    uint32_t NumNames = readU32();
+    NumItems = readU32();
+    uint32_t NameSize = readU32();
+    uint32_t CodeSize = readU32();
+    if (Failed || static_cast<size_t>(End - Cur) != static_cast<size_t>(NameSize) + CodeSize)
+    {
+        LogError(NoLocation, "truncated binary AST file");
+        return false;
+    }
+    // every name takes at least its length byte, every item at least a kind, a name and an argument count
+    if (NumNames > NameSize || NumItems > CodeSize / 3)
+    {
+        LogError(NoLocation, "corrupt binary AST header");
+        return false;
+    }
+
+    const char *CodeStart = Cur + NameSize;
+    Names.reserve(NumNames);
+    for (uint32_t i = 0; i != NumNames; ++i)
+    {
+        uint32_t Length = readVarint();
+        if (Failed || static_cast<size_t>(CodeStart - Cur) < Length)
+        {
+            LogError(NoLocation, "corrupt name table in binary AST file");
+            return false;
+        }
+        Names.emplace_back(Cur, Length);
+        Cur += Length;
+    }
+    if (Cur != CodeStart)
+    {
+        LogError(NoLocation, "corrupt name table in binary AST file");
+        return false;
+    }
+    return true;
+}
+
+// deeper than this is a corrupt file, not a program: the code generator's recursion
+// runs out of an 8 MiB stack at around 60000 levels
+static const unsigned MaxASTDepth = 32768;
+
+static unique_ptr<ExprAST> ReadExpr(ASTReader &R, unsigned Depth = 0)
+{
+    if (Depth == MaxASTDepth)
+        return nullptr; // reported as a corrupt record
+    switch (R.readU8())
+    {
+    case tag_number:
+        return make_unique<NumberExprAST>(R.readF64());
+    case tag_decimal:
+    {
+        uint32_t Digits = R.readVarint();
+        uint8_t Scale = R.readU8();
+        if (Scale > MaxDecimalScale)
+            return nullptr;
+        return make_unique<NumberExprAST>(Digits / Pow10[Scale]);
+    }
+    case tag_variable:
+        return make_unique<VariableExprAST>(R.readName());
+    case tag_binary:
+    {
+        char Op = R.readU8();
+        auto LHS = ReadExpr(R, Depth + 1);
+        if (!LHS)
+            return nullptr;
+        auto RHS = ReadExpr(R, Depth + 1);
+        if (!RHS)
+            return nullptr;
+        return make_unique<BinaryExprAST>(Op, move(LHS), move(RHS));
+    }
+    case tag_call:
+    {
+        const string &Callee = R.readName(); // Names is complete, the reference stays valid
+        uint32_t NumArgs = R.readVarint();
+        vector<unique_ptr<ExprAST>> Args;
+        for (uint32_t i = 0; i != NumArgs && !R.failed(); ++i)
+        {
+            auto Arg = ReadExpr(R, Depth + 1);
+            if (!Arg)
+                return nullptr;
+            Args.push_back(move(Arg));
+        }
+        return make_unique<CallExprAST>(Callee, move(Args));
+    }
+    default:
+        return nullptr; // corrupt tag or end of buffer
+    }
+}
+
+static unique_ptr<PrototypeAST> ReadPrototype(ASTReader &R)
+{
+    const string &Name = R.readName();
+    uint32_t NumArgs = R.readVarint();
+    vector<string> Args;
+    for (uint32_t i = 0; i != NumArgs && !R.failed(); ++i)
+        Args.push_back(R.readName());
+    if (R.failed())
+        return nullptr;
+    return make_unique<PrototypeAST>(Name, move(Args));
+}
+
+// write a parsed program to Path
+static bool SaveProgram(const ProgramAST &Program, const string &Path)
+{
+    ASTWriter W;
+    for (auto &Item : Program)
+    {
+        W.writeU8(Item.Kind);
+        if (Item.Kind == TopLevelAST::Extern)
+            Item.Proto->serialize(W);
+        else
+            Item.Fn->serialize(W);
+    }
+    return W.writeFile(Path, Program.size());
+}
+
+// rebuild a program from a binary AST held in memory (usually a mapped file)
+static bool LoadProgram(const MemoryBuffer &Buffer, ProgramAST &Program)
+{
+    ASTReader R(Buffer.getBufferStart(), Buffer.getBufferEnd());
+    uint32_t NumItems;
+    if (!R.readHeader(NumItems))
+        return false;
+
+    Program.reserve(Program.size() + NumItems);
+    for (uint32_t i = 0; i != NumItems; ++i)
+    {
+        TopLevelAST Item;
+        Item.Kind = static_cast<TopLevelAST::ItemKind>(R.readU8());
+        auto Proto = ReadPrototype(R);
+        if (Proto && Item.Kind == TopLevelAST::Extern)
+            Item.Proto = move(Proto);
+        else if (Proto && (Item.Kind == TopLevelAST::Definition || Item.Kind == TopLevelAST::Expression))
+        {
+            if (auto Body = ReadExpr(R))
+                Item.Fn = make_unique<FunctionAST>(move(Proto), move(Body));
+        }
+
+        if (R.failed() || (!Item.Fn && !Item.Proto))
+        {
+            LogError(NoLocation, "corrupt record in binary AST file");
+            return false;
+        }
+        Program.push_back(move(Item));
+    }
+
+    if (!R.atEnd())
+    {
+        LogError(NoLocation, "trailing bytes in binary AST file");
+        return false;
+    }
+    return true;
+}
+
 // THE CODE GENERATOR
-static unique_ptr<LLVMContext> TheContext; // owns core LLVM data structures
-static unique_ptr<IRBuilder<>> Builder;    // helper object for generating LLVM instructions
-static unique_ptr<Module> TheModule;       // LLVM construct with functions and global variables
-static map<string, Value *> NamedValues;   // store defined identifiers -> symbol table
+// per thread, so batch partitions (see PARALLEL BATCH) can generate code side by side
+static ThreadSafeContext TheTSCtx;                    // owns core LLVM data structures, shared with the jit
+static thread_local LLVMContext *TheContext;          // TheTSCtx's context, or a batch partition's
+static thread_local unique_ptr<IRBuilder<>> Builder;  // helper object for generating LLVM instructions
+static thread_local unique_ptr<Module> TheModule;     // LLVM construct with functions and global variables
+static thread_local map<string, Value *> NamedValues; // store defined identifiers -> symbol table
 // optimizer
-static unique_ptr<legacy::FunctionPassManager> TheFPM;
+static thread_local unique_ptr<legacy::FunctionPassManager> TheFPM;
+// jit
+static unique_ptr<KaleidoscopeJIT> TheJIT;                // compiles finished modules to machine code
+static map<string, unique_ptr<PrototypeAST>> FunctionProtos; // latest prototype of every function, across modules
+static ExitOnError ExitOnErr;
+
+// RUNTIME LIBRARY
+// host functions an extern binds to without a dynamic symbol search. math entries
+// with an intrinsic are called as llvm.* so the optimizer can fold and lower them.
+extern "C" double putchard(double X) // putchar that takes a double and returns 0
+{
+    fputc(static_cast<char>(X), stderr);
+    return 0;
+}
+
+extern "C" double printd(double X) // printf("%f\n") that returns 0
+{
+    fprintf(stderr, "%f\n", X);
+    return 0;
+}
+
+struct BuiltinFunction
+{
+    const char *Name;
+    unsigned NumArgs;
+    Intrinsic::ID IID; // not_intrinsic for plain calls
+    JITTargetAddress Addr;
+};
+
+typedef double (*UnaryFn)(double);
+typedef double (*BinaryFn)(double, double);
+typedef double (*TernaryFn)(double, double, double);
+
+static const BuiltinFunction Builtins[] = {
+    {"sqrt", 1, Intrinsic::sqrt, pointerToJITTargetAddress(static_cast<UnaryFn>(::sqrt))},
+    {"sin", 1, Intrinsic::sin, pointerToJITTargetAddress(static_cast<UnaryFn>(::sin))},
+    {"cos", 1, Intrinsic::cos, pointerToJITTargetAddress(static_cast<UnaryFn>(::cos))},
+    {"exp", 1, Intrinsic::exp, pointerToJITTargetAddress(static_cast<UnaryFn>(::exp))},
+    {"exp2", 1, Intrinsic::exp2, pointerToJITTargetAddress(static_cast<UnaryFn>(::exp2))},
+    {"log", 1, Intrinsic::log, pointerToJITTargetAddress(static_cast<UnaryFn>(::log))},
+    {"log2", 1, Intrinsic::log2, pointerToJITTargetAddress(static_cast<UnaryFn>(::log2))},
+    {"log10", 1, Intrinsic::log10, pointerToJITTargetAddress(static_cast<UnaryFn>(::log10))},
+    {"fabs", 1, Intrinsic::fabs, pointerToJITTargetAddress(static_cast<UnaryFn>(::fabs))},
+    {"floor", 1, Intrinsic::floor, pointerToJITTargetAddress(static_cast<UnaryFn>(::floor))},
+    {"ceil", 1, Intrinsic::ceil, pointerToJITTargetAddress(static_cast<UnaryFn>(::ceil))},
+    {"trunc", 1, Intrinsic::trunc, pointerToJITTargetAddress(static_cast<UnaryFn>(::trunc))},
+    {"round", 1, Intrinsic::round, pointerToJITTargetAddress(static_cast<UnaryFn>(::round))},
+    {"rint", 1, Intrinsic::rint, pointerToJITTargetAddress(static_cast<UnaryFn>(::rint))},
+    {"nearbyint", 1, Intrinsic::nearbyint, pointerToJITTargetAddress(static_cast<UnaryFn>(::nearbyint))},
+    {"pow", 2, Intrinsic::pow, pointerToJITTargetAddress(static_cast<BinaryFn>(::pow))},
+    {"copysign", 2, Intrinsic::copysign, pointerToJITTargetAddress(static_cast<BinaryFn>(::copysign))},
+    {"fmin", 2, Intrinsic::minnum, pointerToJITTargetAddress(static_cast<BinaryFn>(::fmin))},
+    {"fmax", 2, Intrinsic::maxnum, pointerToJITTargetAddress(static_cast<BinaryFn>(::fmax))},
+    {"fma", 3, Intrinsic::fma, pointerToJITTargetAddress(static_cast<TernaryFn>(::fma))},
+    {"tan", 1, Intrinsic::not_intrinsic, pointerToJITTargetAddress(static_cast<UnaryFn>(::tan))},
+    {"asin", 1, Intrinsic::not_intrinsic, pointerToJITTargetAddress(static_cast<UnaryFn>(::asin))},
+    {"acos", 1, Intrinsic::not_intrinsic, pointerToJITTargetAddress(static_cast<UnaryFn>(::acos))},
+    {"atan", 1, Intrinsic::not_intrinsic, pointerToJITTargetAddress(static_cast<UnaryFn>(::atan))},
+    {"sinh", 1, Intrinsic::not_intrinsic, pointerToJITTargetAddress(static_cast<UnaryFn>(::sinh))},
+    {"cosh", 1, Intrinsic::not_intrinsic, pointerToJITTargetAddress(static_cast<UnaryFn>(::cosh))},
+    {"tanh", 1, Intrinsic::not_intrinsic, pointerToJITTargetAddress(static_cast<UnaryFn>(::tanh))},
+    {"cbrt", 1, Intrinsic::not_intrinsic, pointerToJITTargetAddress(static_cast<UnaryFn>(::cbrt))},
+    {"atan2", 2, Intrinsic::not_intrinsic, pointerToJITTargetAddress(static_cast<BinaryFn>(::atan2))},
+    {"fmod", 2, Intrinsic::not_intrinsic, pointerToJITTargetAddress(static_cast<BinaryFn>(::fmod))},
+    {"hypot", 2, Intrinsic::not_intrinsic, pointerToJITTargetAddress(static_cast<BinaryFn>(::hypot))},
+    {"putchard", 1, Intrinsic::not_intrinsic, pointerToJITTargetAddress(&putchard)},
+    {"printd", 1, Intrinsic::not_intrinsic, pointerToJITTargetAddress(&printd)},
+};
+
+static const BuiltinFunction *findBuiltin(const string &Name)
+{
+    for (auto &B : Builtins)
+        if (Name == B.Name)
+            return &B;
+    return nullptr;
+}
+
+static std::set<string> Externs;            // names whose latest prototype is an extern, not a definition
+static vector<string> PendingExterns;       // declared since the last batch went to the jit
+static std::set<string> RegisteredExterns;  // already defined in the jit
+static std::set<string> JITDefinitions;     // names a definition has been added to the jit for
+
+// bind every extern declared since the last call in one absolute-symbols batch:
+// builtins from the table, the rest from the process. anything not found is left
+// to the jit's process search generator, which reports it as before.
+static void registerPendingExterns()
+{
+    vector<std::pair<string, JITTargetAddress>> Batch;
+    for (auto &Name : PendingExterns)
+    {
+        if (!Externs.count(Name) || RegisteredExterns.count(Name))
+            continue; // redefined since, or bound already
+
+        JITTargetAddress Addr;
+        if (auto *B = findBuiltin(Name))
+            Addr = B->Addr;
+        else
+            Addr = pointerToJITTargetAddress(sys::DynamicLibrary::SearchForAddressOfSymbol(Name));
+        if (!Addr)
+            continue;
+
+        Batch.push_back({Name, Addr});
+        RegisteredExterns.insert(Name);
+    }
+    PendingExterns.clear();
+
+    if (!Batch.empty())
+        ExitOnErr(TheJIT->defineAbsoluteSymbols(Batch));
+}
+
+// PROFILE-GUIDED OPTIMIZATION
+// --profile-generate makes jitted functions count their entries and each of their
+// call sites (numbered in source order) into host counters, written out at exit.
+// --profile-use reads them back: functions get entry counts, calls get weights,
+// never-run functions are marked cold, and hot call sites are inlined by emitting
+// the callee's body in place. there are no branches or loops to weight yet.
+static const uint64_t HotCallFraction = 10; // hot: within 10x of the hottest call site
+static const unsigned MaxInlineDepth = 4;
+
+static bool ProfileGenerate = false;
+static bool ProfileUse = false;
+static string ProfilePath;
+
+static std::deque<uint64_t> Counters;                           // stable addresses for the instrumented code
+static map<string, uint64_t *> EntryCounters;                    // function -> counter
+static map<std::pair<string, unsigned>, uint64_t *> CallCounters; // (caller, call site) -> counter
+
+static map<string, uint64_t> EntryCounts; // loaded profile
+static map<std::pair<string, unsigned>, uint64_t> CallCounts;
+static uint64_t HotCallCount = 1;
+static map<string, unique_ptr<ExprAST>> InlineBodies; // definitions kept for inlining hot call sites
+
+static thread_local string CurrentFunction; // function being generated, and its next call site number
+static thread_local unsigned NextCallSite = 0;
+static thread_local unsigned InlineDepth = 0;
+
+static uint64_t *newCounter()
+{
+    Counters.push_back(0);
+    return &Counters.back();
+}
+
+// ++*Counter, with the counter's host address baked into the code
+static void emitCounterIncrement(uint64_t *Counter)
+{
+    Type *I64 = Type::getInt64Ty(*TheContext);
+    Value *Ptr = Builder->CreateIntToPtr(ConstantInt::get(I64, reinterpret_cast<uintptr_t>(Counter)),
+                                         I64->getPointerTo(), "prof.ptr");
+    Value *Count = Builder->CreateLoad(I64, Ptr, "prof.count");
+    Builder->CreateStore(Builder->CreateAdd(Count, ConstantInt::get(I64, 1), "prof.inc"), Ptr);
+}
 
-Value *LogErrorV(const char *Str)
+// format: "function <name> <entries>" and "call <caller> <site> <count>" lines
+static void saveProfile()
 {
-    LogError(Str);
+    std::error_code EC;
+    raw_fd_ostream OS(ProfilePath, EC, sys::fs::OF_Text);
+    if (EC)
+    {
+        LogError(NoLocation, "could not write profile '" + ProfilePath + "': " + EC.message());
+        return;
+    }
+    OS << "# kaleidoscope profile v1\n";
+    for (auto &E : EntryCounters)
+        OS << "function " << E.first << ' ' << *E.second << '\n';
+    for (auto &C : CallCounters)
+        OS << "call " << C.first.first << ' ' << C.first.second << ' ' << *C.second << '\n';
+}
+
+static bool loadProfile()
+{
+    auto Buffer = MemoryBuffer::getFile(ProfilePath, /*IsText=*/true);
+    if (!Buffer)
+    {
+        LogError(NoLocation, "could not read profile '" + ProfilePath + "': " + Buffer.getError().message());
+        return false;
+    }
+
+    uint64_t MaxCallCount = 0;
+    for (line_iterator Line(**Buffer, /*SkipBlanks=*/true, '#'); !Line.is_at_eof(); ++Line)
+    {
+        SmallVector<StringRef, 4> Fields;
+        Line->split(Fields, ' ', -1, /*KeepEmpty=*/false);
+        uint64_t Count;
+        unsigned Site;
+        if (Fields.size() == 3 && Fields[0] == "function" && !Fields[2].getAsInteger(10, Count))
+            EntryCounts[Fields[1].str()] = Count;
+        else if (Fields.size() == 4 && Fields[0] == "call" && !Fields[2].getAsInteger(10, Site) &&
+                 !Fields[3].getAsInteger(10, Count))
+        {
+            CallCounts[{Fields[1].str(), Site}] = Count;
+            MaxCallCount = std::max(MaxCallCount, Count);
+        }
+        else
+        {
+            LogError(NoLocation, "malformed profile line: " + Line->str());
+            return false;
+        }
+    }
+    HotCallCount = std::max<uint64_t>(1, MaxCallCount / HotCallFraction);
+    return true;
+}
+
+Value *LogErrorV(SourceLocation Loc, const char *Str)
+{
+    LogError(Loc, Str);
     return nullptr;
 }
 
@@ -466,7 +1235,7 @@ Value *VariableExprAST::codegen()
 {
     Value *V = NamedValues[Name]; // find in symbol table
     if (!V)
-        LogErrorV("Unknown variable name - Sijui"); // not in table
+        LogErrorV(getLoc(), "Unknown variable name - Sijui"); // not in table
     return V;
 }
 
@@ -490,19 +1259,34 @@ Value *BinaryExprAST::codegen()
         L = Builder->CreateFCmpULT(L, R, "cmptmp");                                 // comparison <>
         return Builder->CreateUIToFP(L, Type::getDoubleTy(*TheContext), "booltmp"); // Convert bool 0/1 to double 0.0 or 1.0
     default:
-        return LogErrorV("Invalid binary operator"); // report error
+        return LogErrorV(getLoc(), "Invalid binary operator"); // report error
     }
 }
 
+// find a function in the current module, or re-declare it from its prototype
+// when it was emitted into an earlier (already jitted) module
+Function *getFunction(const string &Name)
+{
+    if (auto *F = TheModule->getFunction(Name))
+        return F;
+
+    auto FI = FunctionProtos.find(Name);
+    if (FI != FunctionProtos.end())
+        return FI->second->codegen();
+
+    return nullptr;
+}
+
 // code generation for function calls
 Value *CallExprAST::codegen()
 {
-    Function *CalleeF = TheModule->getFunction(Callee); // lookup name in symbol table
+    unsigned Site = NextCallSite++;          // numbered before the arguments, same order in every run
+    Function *CalleeF = getFunction(Callee); // lookup name in symbol table
     if (!CalleeF)
-        return LogErrorV("Unknown function referenced"); // report error
+        return LogErrorV(getLoc(), "Unknown function referenced"); // report error
 
     if (CalleeF->arg_size() != Args.size())               // arguments mistmatch
-        return LogErrorV("Incorrect # arguments passed"); // remort error
+        return LogErrorV(getLoc(), "Incorrect # arguments passed"); // remort error
     // no errors, proceed
     vector<Value *> ArgsV;
     for (unsigned i = 0, e = Args.size(); i != e; ++i)
@@ -512,7 +1296,49 @@ Value *CallExprAST::codegen()
             return nullptr; // return null pointer
     }
 
-    return Builder->CreateCall(CalleeF, ArgsV, "calltmp"); // create call instruction, with function name and a set of arguments
+    bool Profiled = CurrentFunction != "__anon_expr"; // top-level expressions run once
+    if (ProfileGenerate && Profiled && !InlineDepth)
+    {
+        auto &Counter = CallCounters[{CurrentFunction, Site}];
+        if (!Counter)
+            Counter = newCounter();
+        emitCounterIncrement(Counter);
+    }
+
+    auto CI = CallCounts.find({CurrentFunction, Site});
+    bool HasCount = ProfileUse && Profiled && CI != CallCounts.end();
+    auto BI = InlineBodies.find(Callee);
+    if (HasCount && CI->second >= HotCallCount && BI != InlineBodies.end() && InlineDepth < MaxInlineDepth)
+    {
+        // hot call site: generate the callee's body here with its parameters bound
+        // to the already evaluated arguments, its own call sites keep their numbers
+        auto SavedValues = NamedValues;
+        auto SavedFunction = CurrentFunction;
+        unsigned SavedSite = NextCallSite;
+        NamedValues.clear();
+        unsigned idx = 0;
+        for (auto &Param : FunctionProtos[Callee]->getArgs())
+            NamedValues[Param] = ArgsV[idx++];
+        CurrentFunction = Callee;
+        NextCallSite = 0;
+        ++InlineDepth;
+        Value *V = BI->second->codegen();
+        --InlineDepth;
+        NamedValues = SavedValues;
+        CurrentFunction = SavedFunction;
+        NextCallSite = SavedSite;
+        return V;
+    }
+
+    const BuiltinFunction *B = Externs.count(Callee) ? findBuiltin(Callee) : nullptr;
+    if (B && B->IID != Intrinsic::not_intrinsic && B->NumArgs == Args.size()) // known math extern
+        CalleeF = Intrinsic::getDeclaration(TheModule.get(), B->IID, {Type::getDoubleTy(*TheContext)});
+
+    CallInst *Call = Builder->CreateCall(CalleeF, ArgsV, "calltmp"); // create call instruction, with function name and a set of arguments
+    if (HasCount)
+        Call->setMetadata(LLVMContext::MD_prof,
+                          MDBuilder(*TheContext).createBranchWeights(std::min<uint64_t>(CI->second, UINT32_MAX))); // call count
+    return Call;
 }
 
 // code generation for function prototypes
@@ -533,10 +1359,26 @@ Function *PrototypeAST::codegen()
 // code generation for function definition
 Function *FunctionAST::codegen()
 {
-    Function *TheFunction = TheModule->getFunction(Proto->getName()); // get function from proto based on name
-
+    string Name = Proto->getName();
+    bool WasExtern = Externs.erase(Name); // calls in the body go to the definition, not the host function
+    auto *TheFunction = codegenBody(*Proto);
     if (!TheFunction)
-        TheFunction = Proto->codegen(); // not in table, define a new function
+    {
+        if (WasExtern)
+            Externs.insert(Name);
+        return nullptr; // a failed definition leaves no prototype behind for later calls
+    }
+    FunctionProtos[Name] = move(Proto); // keep the prototype around for later modules
+    return TheFunction;
+}
+
+// code generation for the body against an already registered prototype
+Function *FunctionAST::codegenBody(PrototypeAST &P)
+{
+    Function *TheFunction = getFunction(P.getName()); // get function from proto based on name
+
+    if (!TheFunction)
+        TheFunction = P.codegen(); // not in table, define a new function
 
     if (!TheFunction)
         return nullptr; // otherwise return a null pointer
@@ -544,6 +1386,26 @@ Function *FunctionAST::codegen()
     BasicBlock *BB = BasicBlock::Create(*TheContext, "entry", TheFunction); // create new and name basic block -> insert into function
     Builder->SetInsertPoint(BB);                                            // insert new instructions to end of basic block
 
+    CurrentFunction = P.getName(); // call sites are numbered per function
+    NextCallSite = 0;
+    if (ProfileGenerate && CurrentFunction != "__anon_expr")
+    {
+        auto &Counter = EntryCounters[CurrentFunction];
+        if (!Counter)
+            Counter = newCounter();
+        emitCounterIncrement(Counter);
+    }
+    auto EI = EntryCounts.find(CurrentFunction);
+    if (ProfileUse && EI != EntryCounts.end())
+    {
+        TheFunction->setEntryCount(EI->second);
+        if (EI->second == 0) // never ran in the training run
+        {
+            TheFunction->addFnAttr(Attribute::Cold);
+            TheFunction->addFnAttr(Attribute::OptimizeForSize);
+        }
+    }
+
     NamedValues.clear();                  // clear map
     for (auto &Arg : TheFunction->args()) // add function arguments to map after clearing it
         NamedValues[string(Arg.getName())] = &Arg;
@@ -559,15 +1421,156 @@ Function *FunctionAST::codegen()
 
         return TheFunction; // return function
     }
-    TheFunction->eraseFromParent(); // otherwise cleanup
-    return nullptr;                 // return null pointer
+    TheFunction->deleteBody(); // otherwise cleanup, recursive calls go with the body
+    if (TheFunction->use_empty())
+        TheFunction->eraseFromParent(); // earlier functions of a batch partition may still call it as a declaration
+    return nullptr;                     // return null pointer
+}
+
+// JIT
+void InitializeJIT(void)
+{
+    InitializeNativeTarget(); // let the jit emit code for this machine
+    InitializeNativeTargetAsmPrinter();
+    InitializeNativeTargetAsmParser();
+    TheJIT = ExitOnErr(KaleidoscopeJIT::Create());
+    TheJIT->setErrorReporter([](Error Err)
+                             { LogError(NoLocation, toString(move(Err))); }); // with the other diagnostics
+}
+
+// MEMORY FOOTPRINT
+// a context uniques every type and constant it has seen for as long as it lives,
+// so one context per module is the tightest bound but costs a context creation
+// per definition. a session (--session) shares each context between a batch of
+// modules and recycles it after ContextRecycleInterval of them.
+static unsigned ContextRecycleInterval = 1; // modules per context
+static unsigned ModulesInContext = 0;
+static unsigned long ContextsCreated = 0;
+static unsigned long ModulesCreated = 0;
+
+// resident set size in bytes, 0 where the platform doesn't expose it cheaply
+static size_t currentRSS()
+{
+#ifdef __linux__
+    long Pages = 0;
+    if (FILE *F = fopen("/proc/self/statm", "r"))
+    {
+        long Size;
+        if (fscanf(F, "%ld %ld", &Size, &Pages) != 2)
+            Pages = 0;
+        fclose(F);
+    }
+    return static_cast<size_t>(Pages) * sysconf(_SC_PAGESIZE);
+#else
+    return 0;
+#endif
+}
+
+static size_t peakRSS()
+{
+    struct rusage Usage;
+    getrusage(RUSAGE_SELF, &Usage);
+#ifdef __APPLE__
+    return Usage.ru_maxrss; // bytes
+#else
+    return static_cast<size_t>(Usage.ru_maxrss) * 1024; // kilobytes
+#endif
+}
+
+// bytes malloc has handed out and not been given back, which is where contexts,
+// modules and their IR live. llvm keeps no byte count per context or module.
+static size_t heapInUse()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+    struct mallinfo2 Info = mallinfo2();
+    return Info.uordblks + Info.hblkhd;
+#else
+    return 0;
+#endif
+}
+
+// the heap is sampled at every module and context boundary. a module's or a
+// context's size is how much the heap grew while it was the current one, which
+// also takes in whatever else was allocated and kept meanwhile.
+static size_t PeakHeapBytes = 0;
+static size_t ContextHeapStart = 0;
+static size_t LastContextBytes = 0; // the last recycled context
+static size_t PeakContextBytes = 0;
+static size_t ModuleHeapStart = 0;
+static size_t LastModuleBytes = 0; // the last module handed to the jit
+static size_t PeakModuleBytes = 0;
+
+static size_t sampleHeap()
+{
+    size_t Heap = heapInUse();
+    PeakHeapBytes = std::max(PeakHeapBytes, Heap);
+    return Heap;
+}
+
+static size_t heapGrowth(size_t Now, size_t Start)
+{
+    return Now > Start ? Now - Start : 0; // frees of older allocations can outweigh it
+}
+
+// current and peak memory of the process and each component we can account for
+static void printMemoryStats(const char *When)
+{
+    const double MiB = 1024.0 * 1024.0;
+    size_t RSS = currentRSS();
+    size_t Heap = sampleHeap();
+    fprintf(stderr, "memory %s:\n", When);
+    fprintf(stderr, "  process rss       %8.1f MiB (peak %.1f MiB)\n", RSS / MiB, std::max(RSS, peakRSS()) / MiB);
+    fprintf(stderr, "  malloc heap       %8.1f MiB (peak %.1f MiB at a module boundary)\n", Heap / MiB, PeakHeapBytes / MiB);
+    fprintf(stderr, "  jit code and data %8.1f KiB (peak %.1f KiB)\n",
+            TheJIT->getLiveCodeBytes() / 1024.0, TheJIT->getPeakCodeBytes() / 1024.0);
+    fprintf(stderr, "  llvm contexts     %8lu created, %lu modules, %u in the current context\n",
+            ContextsCreated, ModulesCreated, ModulesInContext);
+    fprintf(stderr, "  current context   %8.1f KiB of heap (last recycled %.1f KiB, peak %.1f KiB)\n",
+            heapGrowth(Heap, ContextHeapStart) / 1024.0, LastContextBytes / 1024.0, PeakContextBytes / 1024.0);
+    fprintf(stderr, "  last module       %8.1f KiB of heap (peak %.1f KiB)\n",
+            LastModuleBytes / 1024.0, PeakModuleBytes / 1024.0);
+    fprintf(stderr, "  prototypes        %8zu\n", FunctionProtos.size());
 }
 
 // OPTIMIZATION
+static void InitializeModule(void);
+
 void InitializeModuleAndPassManager(void)
 {
-    TheContext = make_unique<LLVMContext>();                          // new context
+    size_t Heap = sampleHeap(); // the module just handed to the jit is complete
+    if (ModulesCreated)
+    {
+        LastModuleBytes = heapGrowth(Heap, ModuleHeapStart);
+        PeakModuleBytes = std::max(PeakModuleBytes, LastModuleBytes);
+    }
+    TheFPM.reset(); // drop anything still pointing into the old context first
+    Builder.reset();
+    TheModule.reset();
+    if (!TheContext || ModulesInContext == ContextRecycleInterval)
+    {
+        if (TheContext)
+        {
+            LastContextBytes = heapGrowth(Heap, ContextHeapStart);
+            PeakContextBytes = std::max(PeakContextBytes, LastContextBytes);
+        }
+        ContextHeapStart = sampleHeap();
+        TheTSCtx = ThreadSafeContext(make_unique<LLVMContext>()); // new context, the jit keeps the old one while it needs it
+        TheContext = TheTSCtx.getContext();
+        ModulesInContext = 0;
+        ++ContextsCreated;
+    }
+    ++ModulesInContext;
+    ++ModulesCreated;
+    ModuleHeapStart = sampleHeap();
+    InitializeModule();
+}
+
+// new module, builder and pass pipeline in TheContext
+static void InitializeModule(void)
+{
     TheModule = make_unique<Module>("JIT AND OPTIMIZE", *TheContext); // create new module
+    if (TheJIT)
+        TheModule->setDataLayout(TheJIT->getDataLayout()); // match the jit target
 
     Builder = make_unique<IRBuilder<>>(*TheContext); // new builder for module
 
@@ -581,58 +1584,261 @@ void InitializeModuleAndPassManager(void)
     TheFPM->doInitialization();
 }
 
-// TOP_LEVEL PARSING
-static void handleDefinition()
+// INTERPRETER
+// one-shot top-level expressions are walked directly instead of going through
+// codegen, the pass pipeline and machine-code emission. calls go straight to
+// the jitted callee. anything the tree walker can't handle is compiled.
+static const unsigned MaxInterpretedArgs = 6;    // arities callCompiled() can dispatch
+static const unsigned MaxInterpretedCost = 1024; // nodes, a deeper tree is worth compiling
+static bool UseInterpreter = true;               // --no-interpreter always compiles
+
+// call jitted code with the C calling convention of a Kaleidoscope function
+static double callCompiled(JITTargetAddress Addr, const double *A, size_t NumArgs)
 {
-    if (auto FnAST = ParseDefinition())
+    switch (NumArgs)
+    {
+    case 0:
+        return jitTargetAddressToFunction<double (*)()>(Addr)();
+    case 1:
+        return jitTargetAddressToFunction<double (*)(double)>(Addr)(A[0]);
+    case 2:
+        return jitTargetAddressToFunction<double (*)(double, double)>(Addr)(A[0], A[1]);
+    case 3:
+        return jitTargetAddressToFunction<double (*)(double, double, double)>(Addr)(A[0], A[1], A[2]);
+    case 4:
+        return jitTargetAddressToFunction<double (*)(double, double, double, double)>(Addr)(A[0], A[1], A[2], A[3]);
+    case 5:
+        return jitTargetAddressToFunction<double (*)(double, double, double, double, double)>(Addr)(A[0], A[1], A[2], A[3], A[4]);
+    default:
+        return jitTargetAddressToFunction<double (*)(double, double, double, double, double, double)>(Addr)(A[0], A[1], A[2], A[3], A[4], A[5]);
+    }
+}
+
+bool NumberExprAST::interpretable(unsigned &Cost)
+{
+    ++Cost;
+    return true;
+}
+
+double NumberExprAST::interpret() const
+{
+    return Val;
+}
+
+// top-level expressions have no variables in scope, codegen reports the error
+bool VariableExprAST::interpretable(unsigned &)
+{
+    return false;
+}
+
+double VariableExprAST::interpret() const
+{
+    return 0;
+}
+
+bool BinaryExprAST::interpretable(unsigned &Cost)
+{
+    if (++Cost > MaxInterpretedCost)
+        return false;
+    switch (Op)
+    {
+    case '+':
+    case '-':
+    case '*':
+    case '<':
+        return LHS->interpretable(Cost) && RHS->interpretable(Cost);
+    default:
+        return false; // invalid operator, codegen reports the error
+    }
+}
+
+double BinaryExprAST::interpret() const
+{
+    double L = LHS->interpret();
+    double R = RHS->interpret();
+    switch (Op)
+    {
+    case '+':
+        return L + R;
+    case '-':
+        return L - R;
+    case '*':
+        return L * R;
+    default:                                   // '<'
+        return !(L >= R) ? 1.0 : 0.0; // unordered or less than, like fcmp ult
+    }
+}
+
+// the callee has to be a known function that the jit can hand us an address for
+bool CallExprAST::interpretable(unsigned &Cost)
+{
+    if (++Cost > MaxInterpretedCost || Args.size() > MaxInterpretedArgs)
+        return false;
+
+    auto FI = FunctionProtos.find(Callee);
+    if (FI == FunctionProtos.end() || FI->second->getArgs().size() != Args.size())
+        return false; // codegen reports unknown functions and arity mismatches
+
+    for (auto &Arg : Args)
+        if (!Arg->interpretable(Cost))
+            return false;
+
+    if (Externs.count(Callee))
+    {
+        if (auto *B = findBuiltin(Callee)) // host function, no jit lookup needed
+        {
+            CalleeAddr = B->Addr;
+            return true;
+        }
+        registerPendingExterns();
+    }
+
+    auto Sym = TheJIT->lookup(Callee); // compiles the callee's module on first use
+    if (!Sym)
     {
-        if (auto *FnIR = FnAST->codegen()) // code in IR
+        consumeError(Sym.takeError());
+        return false;
+    }
+    CalleeAddr = Sym->getAddress();
+    return true;
+}
+
+double CallExprAST::interpret() const
+{
+    double ArgVals[MaxInterpretedArgs];
+    for (size_t i = 0, e = Args.size(); i != e; ++i)
+        ArgVals[i] = Args[i]->interpret();
+    return callCompiled(CalleeAddr, ArgVals, Args.size());
+}
+
+// TOP-LEVEL CODE GENERATION - shared by the repl and the binary AST loader
+static bool EchoItems = true; // print IR and results as items are read, off while soaking
+
+static void emitDefinition(FunctionAST &FnAST)
+{
+    if (JITDefinitions.count(FnAST.getName())) // the jit holds one definition per name
+    {
+        LogError(NoLocation, "redefinition of function '" + FnAST.getName() + "'");
+        return;
+    }
+    if (auto *FnIR = FnAST.codegen()) // code in IR
+    {
+        if (EchoItems)
         {
             fprintf(stderr, "Read function definition:");
             FnIR->print(errs()); // print IR code
             fprintf(stderr, "\n");
         }
-    }
-    else
-    {
-        getNextToken(); // skip token, error recovery
+        if (ProfileUse)
+            InlineBodies[FnIR->getName().str()] = FnAST.takeBody(); // candidate for hot call sites
+        string Name = FnIR->getName().str();
+        registerPendingExterns();
+        if (RegisteredExterns.count(Name)) // bound to the host as an extern, the definition takes the name over
+        {
+            if (auto Err = TheJIT->removeSymbols({Name}))
+                LogError(NoLocation, toString(move(Err)));
+            else
+                RegisteredExterns.erase(Name);
+        }
+        if (auto Err = TheJIT->addModule(ThreadSafeModule(move(TheModule), TheTSCtx))) // hand module to the jit
+            LogError(NoLocation, toString(move(Err)));
+        else
+            JITDefinitions.insert(Name);
+        InitializeModuleAndPassManager(); // fresh module for what follows
     }
 }
 
-static void handleExtern()
+static void emitExtern(unique_ptr<PrototypeAST> ProtoAST)
 {
-    if (auto ProtoAST = ParseExtern())
+    const string &Name = ProtoAST->getName();
+    bool Defined = JITDefinitions.count(Name); // the jitted definition stays, the extern only declares it
+    if (Defined && FunctionProtos[Name]->getArgs().size() != ProtoAST->getArgs().size())
     {
-        if (auto *FnIR = ProtoAST->codegen())
+        LogError(NoLocation, "extern '" + Name + "' does not match the arguments of its definition");
+        return;
+    }
+
+    if (auto *FnIR = ProtoAST->codegen())
+    {
+        if (EchoItems)
         {
             fprintf(stderr, "Read extern: ");
             FnIR->print(errs());
             fprintf(stderr, "\n");
         }
-    }
-    else
-    {
-        getNextToken(); // skip token, error recovery
+        if (Defined)
+            return; // no builtin, intrinsic or host binding for it
+        Externs.insert(Name);
+        PendingExterns.push_back(Name);        // bound with the next batch
+        FunctionProtos[Name] = move(ProtoAST); // visible to later modules
     }
 }
 
-static void handleTopLevelExpression()
+static void emitTopLevelExpression(FunctionAST &FnAST, bool MayInterpret = true)
 {
-    if (auto FnAST = ParseTopLevelExpr()) // evaluate top-level expression into anonymous function
+    unsigned Cost = 0;
+    if (UseInterpreter && MayInterpret && FnAST.getBody().interpretable(Cost)) // cheap enough to walk once
     {
-        if (auto *FnIR = FnAST->codegen())
+        double Result = FnAST.getBody().interpret();
+        if (EchoItems)
+            fprintf(stderr, "Evaluated to %f\n", Result);
+        return;
+    }
+
+    if (auto *FnIR = FnAST.codegen())
+    {
+        if (EchoItems)
         {
             fprintf(stderr, "Read top-level expression:");
             FnIR->print(errs());
             fprintf(stderr, "\n");
+        }
 
-            FnIR->eraseFromParent(); // remove anonymous expression
+        // jit the module holding the anonymous expression, tracked so its memory can be freed afterwards
+        auto RT = TheJIT->getMainJITDylib().createResourceTracker();
+        registerPendingExterns();
+        ExitOnErr(TheJIT->addModule(ThreadSafeModule(move(TheModule), TheTSCtx), RT));
+        InitializeModuleAndPassManager();
+
+        auto ExprSymbol = TheJIT->lookup("__anon_expr"); // fails when a callee has no definition, e.g. a missing extern
+        if (!ExprSymbol)
+        {
+            LogError(FnAST.getBody().getLoc(), toString(ExprSymbol.takeError()));
+            ExitOnErr(RT->remove());
+            return;
         }
+        double (*FP)() = jitTargetAddressToFunction<double (*)()>(ExprSymbol->getAddress());
+        double Result = FP();
+        if (EchoItems)
+            fprintf(stderr, "Evaluated to %f\n", Result);
+
+        ExitOnErr(RT->remove()); // remove anonymous expression
     }
+}
+
+// TOP_LEVEL PARSING
+static void handleDefinition()
+{
+    if (auto FnAST = ParseDefinition())
+        emitDefinition(*FnAST);
     else
-    {
-        getNextToken(); // skip token, error recovery
-    }
+        synchronize(); // error recovery, on to the next item
+}
+
+static void handleExtern()
+{
+    if (auto ProtoAST = ParseExtern())
+        emitExtern(move(ProtoAST));
+    else
+        synchronize(); // error recovery, on to the next item
+}
+
+static void handleTopLevelExpression()
+{
+    if (auto FnAST = ParseTopLevelExpr()) // evaluate top-level expression into anonymous function
+        emitTopLevelExpression(*FnAST);
+    else
+        synchronize(); // error recovery, on to the next item
 }
 
 // DRIVER CODE - repl
@@ -640,14 +1846,18 @@ static void run()
 {
     while (1)
     {
+        flushDiagnostics(); // errors of the previous item
         fprintf(stderr, "ready> ");
+        if (tooManyErrors())
+            return;
+        size_t ErrorsBefore = ErrorCount;
         switch (currTok)
         {
         case tok_eof:
             return;
         case ';': // ignore top-level semicolons.
             getNextToken();
-            break;
+            continue;
         case tok_def:
             handleDefinition();
             break;
@@ -658,11 +1868,401 @@ static void run()
             handleTopLevelExpression();
             break;
         }
+        if (ErrorCount == ErrorsBefore)
+            ErrorCount = 0; // a clean item ends the run, the repl only gives up on MaxErrors failures in a row
+    }
+}
+
+// BINARY AST DRIVERS
+// --emit-ast: parse stdin and write the binary AST
+static int emitAST(const string &Path)
+{
+    ProgramAST Program;
+    ParseProgram(Program);
+    if (ErrorCount != 0)
+        return 1; // broken items were dropped, don't write a partial program
+    return SaveProgram(Program, Path) ? 0 : 1;
+}
+
+// --load-ast: generate code for a binary AST, skipping lexing and parsing
+static int loadAST(const string &Path)
+{
+    auto Buffer = MemoryBuffer::getFile(Path, /*IsText=*/false, /*RequiresNullTerminator=*/false); // mmap'd when large
+    if (!Buffer)
+    {
+        LogError(NoLocation, "could not read '" + Path + "': " + Buffer.getError().message());
+        return 1;
+    }
+
+    ProgramAST Program;
+    if (!LoadProgram(**Buffer, Program))
+        return 1;
+
+    InitializeJIT();
+    InitializeModuleAndPassManager(); // create module to hold code
+    for (auto &Item : Program)
+    {
+        switch (Item.Kind)
+        {
+        case TopLevelAST::Definition:
+            emitDefinition(*Item.Fn);
+            break;
+        case TopLevelAST::Extern:
+            emitExtern(move(Item.Proto));
+            break;
+        case TopLevelAST::Expression:
+            emitTopLevelExpression(*Item.Fn);
+            break;
+        }
+    }
+    if (ProfileGenerate)
+        saveProfile();
+    return 0;
+}
+
+// --bench-load: time parsing source text against loading its binary AST
+static int benchLoad(const string &TextPath, const string &BinaryPath, int Iterations)
+{
+    typedef std::chrono::steady_clock Clock;
+    size_t NumItems = 0;
+
+    auto Start = Clock::now();
+    for (int i = 0; i != Iterations; ++i)
+    {
+        InputFile = fopen(TextPath.c_str(), "r");
+        if (!InputFile)
+        {
+            LogError(NoLocation, "could not open '" + TextPath + "'");
+            return 1;
+        }
+        lastChar = ' '; // fresh lexer state for every pass
+        LexLoc = {1, 0};
+        ProgramAST Program;
+        ParseProgram(Program);
+        NumItems = Program.size();
+        fclose(InputFile);
+    }
+    auto TextTime = Clock::now() - Start;
+
+    Start = Clock::now();
+    for (int i = 0; i != Iterations; ++i)
+    {
+        auto Buffer = MemoryBuffer::getFile(BinaryPath, /*IsText=*/false, /*RequiresNullTerminator=*/false);
+        ProgramAST Program;
+        if (!Buffer || !LoadProgram(**Buffer, Program) || Program.size() != NumItems)
+        {
+            LogError(NoLocation, "binary AST does not match the source text");
+            return 1;
+        }
+    }
+    auto BinaryTime = Clock::now() - Start;
+
+    double TextUs = std::chrono::duration<double, std::micro>(TextTime).count() / Iterations;
+    double BinaryUs = std::chrono::duration<double, std::micro>(BinaryTime).count() / Iterations;
+    fprintf(stderr, "%zu top-level items, %d iterations\n", NumItems, Iterations);
+    fprintf(stderr, "text parse : %10.1f us/load\n", TextUs);
+    fprintf(stderr, "binary AST : %10.1f us/load (%.1fx faster)\n", BinaryUs, TextUs / BinaryUs);
+    return 0;
+}
+
+// PARALLEL BATCH
+// --batch: generate and optimize a whole file in parallel. definitions are cut,
+// in source order, into partitions of BatchPartitionSize functions, each with its
+// own context, module and pass pipeline. a thread pool takes partitions as threads
+// free up; each one also prints its functions, and the texts are joined in source
+// order around one module of the declarations they call. the cut doesn't depend
+// on the thread count, so neither does the output.
+static const size_t BatchPartitionSize = 32; // functions, small enough to balance, big enough to amortize a context
+
+namespace
+{
+    // an attribute copied out of a partition's context
+    struct BatchAttribute
+    {
+        unsigned Index;           // function, return value or parameter
+        Attribute::AttrKind Kind; // None for string attributes
+        uint64_t Value;
+        string Key, StringValue;
+    };
+
+    // a function a partition calls but doesn't define, by name, signature and the
+    // attributes passes gave it (e.g. library calls instcombine introduced)
+    struct BatchDeclaration
+    {
+        string Name;
+        vector<std::pair<Type::TypeID, unsigned>> Types; // return type first, bit width for integers
+        vector<BatchAttribute> Attributes;
+    };
+
+    struct BatchPartition
+    {
+        vector<std::pair<FunctionAST *, PrototypeAST *>> Functions;
+        string Text;                           // printed definitions
+        vector<string> Defined;                // the ones that generated
+        vector<BatchDeclaration> Declarations; // in module order
+    };
+} // end anonymous namespace
+
+static std::pair<Type::TypeID, unsigned> describeType(Type *T)
+{
+    return {T->getTypeID(), T->isIntegerTy() ? T->getIntegerBitWidth() : 0};
+}
+
+static Type *describedType(std::pair<Type::TypeID, unsigned> T)
+{
+    if (T.first == Type::IntegerTyID)
+        return Type::getIntNTy(*TheContext, T.second);
+    return Type::getPrimitiveType(*TheContext, T.first);
+}
+
+static void compilePartition(BatchPartition &Part)
+{
+    LLVMContext Context;
+    TheContext = &Context;
+    InitializeModule();
+    for (auto &F : Part.Functions)
+        F.first->codegenBody(*F.second);
+
+    raw_string_ostream OS(Part.Text);
+    for (auto &F : *TheModule)
+    {
+        if (!F.isDeclaration())
+        {
+            OS << '\n';
+            F.print(OS); // the module printer's text for it, value numbering is per function
+            Part.Defined.push_back(F.getName().str());
+            continue;
+        }
+        if (F.use_empty())
+            continue; // optimized away, e.g. a math extern lowered to its intrinsic
+        BatchDeclaration D{F.getName().str(), {describeType(F.getReturnType())}, {}};
+        for (auto *Param : F.getFunctionType()->params())
+            D.Types.push_back(describeType(Param));
+        auto Attrs = F.getAttributes();
+        for (unsigned Index : Attrs.indexes())
+            for (auto &A : Attrs.getAttributes(Index))
+            {
+                if (A.isStringAttribute())
+                    D.Attributes.push_back({Index, Attribute::None, 0, A.getKindAsString().str(), A.getValueAsString().str()});
+                else if (!A.isTypeAttribute()) // no calls here pass pointers
+                    D.Attributes.push_back({Index, A.getKindAsEnum(), A.isIntAttribute() ? A.getValueAsInt() : 0, "", ""});
+            }
+        Part.Declarations.push_back(move(D));
+    }
+    OS.flush();
+
+    TheFPM.reset(); // everything that points into Context goes before it
+    Builder.reset();
+    TheModule.reset();
+    TheContext = nullptr;
+}
+
+static int batch(unsigned Jobs)
+{
+    typedef std::chrono::steady_clock Clock;
+    ProgramAST Program;
+    ParseProgram(Program);
+    if (tooManyErrors())
+        return 1;
+    auto Start = Clock::now();
+
+    // prototypes are registered up front, workers only read them
+    vector<BatchPartition> Partitions;
+    vector<string> ExternNames;
+    std::set<string> Defined;
+    for (auto &Item : Program)
+    {
+        if (Item.Kind == TopLevelAST::Extern)
+        {
+            string Name = Item.Proto->getName();
+            if (Defined.count(Name)) // a partition holds the definition's prototype, keep it
+            {
+                if (FunctionProtos[Name]->getArgs().size() != Item.Proto->getArgs().size())
+                    LogError(NoLocation, "extern '" + Name + "' does not match the arguments of its definition");
+                continue;
+            }
+            ExternNames.push_back(Name);
+            Externs.insert(Name);
+            FunctionProtos[Name] = move(Item.Proto);
+        }
+        else if (Item.Kind == TopLevelAST::Definition)
+        {
+            auto Proto = Item.Fn->takeProto();
+            string Name = Proto->getName();
+            if (!Defined.insert(Name).second)
+            {
+                LogError(NoLocation, "redefinition of function '" + Name + "'");
+                continue;
+            }
+            Externs.erase(Name);
+            PrototypeAST *P = Proto.get();
+            FunctionProtos[Name] = move(Proto);
+
+            if (Partitions.empty() || Partitions.back().Functions.size() == BatchPartitionSize)
+                Partitions.emplace_back();
+            Partitions.back().Functions.push_back({Item.Fn.get(), P});
+        }
+        // top-level expressions have nothing to run them in a batch, like the whole-module dump before the jit
     }
+
+    ThreadPool Pool(hardware_concurrency(Jobs));
+    for (auto &Part : Partitions)
+        Pool.async([&Part]
+                   { compilePartition(Part); });
+    Pool.wait();
+    auto Compiled = Clock::now();
+
+    // left for this thread: declaring what no partition defines, in order of first use
+    std::set<string> Generated;
+    for (auto &Part : Partitions)
+        Generated.insert(Part.Defined.begin(), Part.Defined.end());
+    LLVMContext Context;
+    TheContext = &Context;
+    InitializeModule();
+    for (auto &Part : Partitions)
+        for (auto &D : Part.Declarations)
+        {
+            if (Generated.count(D.Name) || TheModule->getFunction(D.Name))
+                continue;
+            vector<Type *> Params;
+            for (size_t i = 1; i != D.Types.size(); ++i)
+                Params.push_back(describedType(D.Types[i]));
+            auto *F = Function::Create(FunctionType::get(describedType(D.Types[0]), Params, false),
+                                       Function::ExternalLinkage, D.Name, TheModule.get());
+            for (auto &A : D.Attributes)
+                F->addAttributeAtIndex(A.Index, A.Kind == Attribute::None ? Attribute::get(*TheContext, A.Key, A.StringValue)
+                                                                          : Attribute::get(*TheContext, A.Kind, A.Value));
+        }
+    for (auto &Name : ExternNames)
+        if (!TheModule->getFunction(Name) && Externs.count(Name)) // declared but never called
+            FunctionProtos[Name]->codegen();
+
+    // module header, the partitions' definitions, then the declarations and attributes
+    string Declarations;
+    raw_string_ostream DOS(Declarations);
+    TheModule->print(DOS, nullptr);
+    DOS.flush();
+    size_t Split = std::min(Declarations.find("\n\n"), Declarations.size() - 1) + 1;
+    auto Merged = Clock::now();
+
+    errs().SetBuffered(); // stderr is unbuffered, one write per token otherwise
+    errs() << StringRef(Declarations).take_front(Split); // print generated code
+    for (auto &Part : Partitions)
+        errs() << Part.Text;
+    errs() << StringRef(Declarations).drop_front(Split);
+    errs().SetUnbuffered();
+    auto Printed = Clock::now();
+
+    typedef std::chrono::duration<double, std::milli> Ms;
+    fprintf(stderr, "batch: %zu functions in %zu partitions, %u threads: %.1f ms compile, %.1f ms merge, %.1f ms output\n",
+            Defined.size(), Partitions.size(), Pool.getThreadCount(),
+            Ms(Compiled - Start).count(), Ms(Merged - Compiled).count(), Ms(Printed - Merged).count());
+
+    TheFPM.reset();
+    Builder.reset();
+    TheModule.reset();
+    TheContext = nullptr;
+    return ErrorCount != 0 ? 1 : 0; // the module above is missing whatever failed
 }
 
-int main()
+// flush what is left of the diagnostics, giving up on the input is a failure
+static int finish(int Status)
 {
+    flushDiagnostics();
+    return tooManyErrors() ? 1 : Status;
+}
+
+// SOAK BENCHMARK
+// --soak: push N top-level expressions through one session and report the
+// footprint as it goes, it should level off after the first report. every
+// expression is compiled, the interpreter would keep most of them out of llvm
+
+static int soak(unsigned long N)
+{
+    typedef std::chrono::steady_clock Clock;
+    EchoItems = false;
+    InitializeJIT();
+    InitializeModuleAndPassManager();
+
+    // def soak(a b) a*b + a - b
+    auto Var = [](const char *Name)
+    { return make_unique<VariableExprAST>(Name); };
+    auto Body = make_unique<BinaryExprAST>(
+        '-', make_unique<BinaryExprAST>('+', make_unique<BinaryExprAST>('*', Var("a"), Var("b")), Var("a")), Var("b"));
+    FunctionAST Def(make_unique<PrototypeAST>("soak", vector<string>{"a", "b"}), move(Body));
+    emitDefinition(Def);
+
+    auto Start = Clock::now();
+    unsigned long ReportEvery = std::max(1ul, N / 10);
+    for (unsigned long i = 1; i <= N; ++i)
+    {
+        // soak(i, i / 2), fresh constants every time
+        vector<unique_ptr<ExprAST>> Args;
+        Args.push_back(make_unique<NumberExprAST>(i));
+        Args.push_back(make_unique<NumberExprAST>(i * 0.5));
+        FunctionAST Expr(make_unique<PrototypeAST>("__anon_expr", vector<string>()),
+                         make_unique<CallExprAST>("soak", move(Args)));
+        emitTopLevelExpression(Expr, /*MayInterpret=*/false);
+
+        if (i % ReportEvery == 0)
+        {
+            double Seconds = std::chrono::duration<double>(Clock::now() - Start).count();
+            fprintf(stderr, "%lu expressions, %.1f s\n", i, Seconds);
+            printMemoryStats("so far");
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    InputFile = stdin;
+
+    vector<string> Args;
+    for (int i = 1; i != argc; ++i)
+    {
+        string Arg = argv[i];
+        if (Arg == "--no-interpreter")
+            UseInterpreter = false; // always compile top-level expressions
+        else if (Arg == "--session")
+            ContextRecycleInterval = 256; // share contexts between modules, report memory at exit
+        else if ((Arg == "--profile-generate" || Arg == "--profile-use") && i + 1 != argc)
+        {
+            ProfileGenerate = Arg == "--profile-generate";
+            ProfileUse = !ProfileGenerate;
+            ProfilePath = argv[++i];
+        }
+        else
+            Args.push_back(Arg);
+    }
+    string Mode = Args.empty() ? "" : Args[0];
+    if (Mode == "--batch" && (ProfileGenerate || ProfileUse))
+    {
+        // counters are shared between threads, and a partition's metadata numbering is its own
+        LogError(NoLocation, "--batch does not take --profile-generate or --profile-use");
+        return finish(1);
+    }
+    if (ProfileUse && !loadProfile())
+        return finish(1);
+
+    if (Mode == "--emit-ast" && Args.size() == 2)
+        return finish(emitAST(Args[1]));
+    if (Mode == "--load-ast" && Args.size() == 2)
+        return finish(loadAST(Args[1]));
+    if (Mode == "--bench-load" && (Args.size() == 3 || Args.size() == 4))
+        return finish(benchLoad(Args[1], Args[2], Args.size() == 4 ? std::max(1, atoi(Args[3].c_str())) : 100));
+    if (Mode == "--batch" && Args.size() <= 2)
+        return finish(batch(Args.size() == 2 ? std::max(0, atoi(Args[1].c_str())) : 0)); // 0: every hardware thread
+    if (Mode == "--soak" && Args.size() <= 2)
+        return finish(soak(Args.size() == 2 ? std::max(1l, atol(Args[1].c_str())) : 1000000));
+    if (!Args.empty())
+    {
+        fprintf(stderr, "usage: %s [--no-interpreter] [--session] [--profile-generate file | --profile-use file] [--emit-ast out.kast | --load-ast in.kast | "
+                        "--bench-load in.k in.kast [iterations] | --batch [threads] | --soak [expressions]]\n",
+                argv[0]);
+        return 1;
+    }
+
     // test lexer
     // while(true)
     //     cout << "Token: " << getTok() << endl;
@@ -671,12 +2271,18 @@ int main()
     // InitializeModuleAndPassManager();
     fprintf(stderr, "ready> ");
     getNextToken();
+    InitializeJIT();
     InitializeModuleAndPassManager(); // create module to hold code
     run();
-    TheModule->print(errs(), nullptr); // print generated code
-    return 0;
+    if (ContextRecycleInterval > 1)
+        printMemoryStats("at exit");
+    if (ProfileGenerate)
+        saveProfile();
+    return finish(0);
 }
 
 // compilation and execution
 // ./build
-// ./main.bin
\ No newline at end of file
+// ./main.bin
+// ./main.bin --emit-ast lib.kast < lib.k   # parse once
+// ./main.bin --load-ast lib.kast           # reload without lexing/parsing
\ No newline at end of file